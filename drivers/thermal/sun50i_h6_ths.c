@@ -17,9 +17,12 @@
  *
  */
 
+#include <linux/bitops.h>
+#include <linux/bug.h>
 #include <linux/clk.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/nvmem-consumer.h>
 #include <linux/of_device.h>
@@ -58,23 +61,39 @@
 #define THS_H6_CTRL0_SENSOR_ACQ0_VALUE	0x1df /* 20us */
 #define THS_H6_CTRL0_UNK		0x0000002f
 
+/*
+ * Scale factors between raw register values and microcelsius, expressed
+ * as fixed-point reciprocal multipliers so the conversions need no
+ * division: 2254699098 / 2^25 ~= 1000000 / 14882 and
+ * 255670813 / 2^34 ~= 14882 / 1000000. Both reproduce the truncating
+ * quotients exactly over the whole 12-bit register range.
+ */
+#define THS_H6_CALC_TEMP_MUL	2254699098U
+#define THS_H6_CALC_TEMP_SHIFT	25
+#define THS_H6_RECALC_REG_MUL	255670813U
+#define THS_H6_RECALC_REG_SHIFT	34
+
 #define THS_H6_CAL_FT_TEMP_MASK		0x0fff
 #define THS_H6_CAL_FT_TEMP_DEVIATION_EN	0x3000
 #define THS_H6_CAL_DEFAULT		0x800
 #define THS_H6_CAL_VAL_MASK		0xfff
 
-struct sun50i_h6_ths_data;
-
+/*
+ * Laid out so that everything the sampling fast path touches sits in
+ * the first few words of the sensor.
+ */
 struct sun50i_h6_ths_sensor {
-	struct sun50i_h6_ths_data *data;
-	int id;
+	void __iomem *regs;
 	struct thermal_zone_device *tzd;
 	u32 val;
+	u32 last_reported;
+	u16 id;
 };
 
 struct sun50i_h6_ths_cfg {
 	int sensor_num;
-	int (*calc_temp)(u32 val);
+	u32 sense_en_mask;
+	u32 irq_en_mask;
 };
 
 struct sun50i_h6_ths_data {
@@ -83,75 +102,117 @@ struct sun50i_h6_ths_data {
 	void __iomem *regs;
 	const struct sun50i_h6_ths_cfg *cfg;
 	struct nvmem_cell *calcell;
+	unsigned long pending;
 	struct sun50i_h6_ths_sensor sensors[THS_H6_MAX_SENSOR_NUM];
 };
 
+/* Measurement period register value, folded once at build time. */
+static const u32 sun50i_h6_ths_per_val =
+	THS_H6_PER_THERMAL_PER(THS_H6_INT_CTRL_THERMAL_PER_VALUE);
+
 static int sun50i_h6_ths_calc_temp(u32 val)
 {
-	return (187744 - (int)((val * 1000000) / 14882));
+	return 187744 - (int)(mul_u32_u32(val, THS_H6_CALC_TEMP_MUL) >>
+			      THS_H6_CALC_TEMP_SHIFT);
 }
 
 static u16 sun50i_h6_ths_recalc_reg(u32 temp)
 {
-	return (u16)(2794 - temp * 14882 / 1000000);
+	return (u16)(2794 - (mul_u32_u32(temp, THS_H6_RECALC_REG_MUL) >>
+			     THS_H6_RECALC_REG_SHIFT));
 }
 
 static int sun50i_h6_ths_get_temp(void *_data, int *out)
 {
 	struct sun50i_h6_ths_sensor *sensor = _data;
 
-	if (sensor->val == 0)
+	/* Only happens before the first sample has arrived. */
+	if (unlikely(sensor->val == 0))
 		return -EBUSY;
 
 	/* Formula and parameters from the Allwinner 3.4 kernel */
-	*out = sensor->data->cfg->calc_temp(sensor->val);
+	*out = sun50i_h6_ths_calc_temp(sensor->val);
 	return 0;
 }
 
-static irqreturn_t sun50i_h6_ths_irq_thread(int irq, void *_data)
+static irqreturn_t sun50i_h6_ths_irq(int irq, void *_data)
 {
 	struct sun50i_h6_ths_data *data = _data;
+	struct sun50i_h6_ths_sensor *sensors = data->sensors;
+	void __iomem *regs = data->regs;
+	irqreturn_t ret = IRQ_HANDLED;
+	unsigned long stat;
+	u32 val;
 	int i;
 
-	for (i = 0; i < data->cfg->sensor_num; i++) {
-		if (!(readl(data->regs + THS_H6_DATA_INT_STAT) &
-		      THS_H6_STAT_DATA_IRQ_STS(i)))
+	/* One STAT word carries the bits of all sensors. */
+	stat = readl_relaxed(regs + THS_H6_DATA_INT_STAT) &
+	       data->cfg->irq_en_mask;
+	if (unlikely(!stat))
+		return IRQ_NONE;
+
+	writel_relaxed(stat, regs + THS_H6_DATA_INT_STAT);
+
+	while (stat) {
+		i = __ffs(stat);
+		stat &= stat - 1;
+
+		val = readl_relaxed(regs + THS_H6_DATA(i));
+		if (unlikely(!val))
 			continue;
 
-		writel(THS_H6_STAT_DATA_IRQ_STS(i),
-		       data->regs + THS_H6_DATA_INT_STAT);
+		/*
+		 * The block samples every 10 ms but the filtered value
+		 * rarely moves between two samples; do not bother waking
+		 * the thread for a reading the zone has already seen.
+		 */
+		if (val == sensors[i].last_reported)
+			continue;
 
-		data->sensors[i].val = readl(data->regs + THS_H6_DATA(i));
-		if (data->sensors[i].val)
-			thermal_zone_device_update(data->sensors[i].tzd,
-						   THERMAL_EVENT_TEMP_SAMPLE);
+		sensors[i].last_reported = val;
+		sensors[i].val = val;
+		set_bit(i, &data->pending);
+		ret = IRQ_WAKE_THREAD;
 	}
 
+	return ret;
+}
+
+static irqreturn_t sun50i_h6_ths_irq_thread(int irq, void *_data)
+{
+	struct sun50i_h6_ths_data *data = _data;
+	struct sun50i_h6_ths_sensor *sensors = data->sensors;
+	unsigned long pending = xchg(&data->pending, 0);
+	int i;
+
+	for_each_set_bit(i, &pending, data->cfg->sensor_num)
+		thermal_zone_device_update(sensors[i].tzd,
+					   THERMAL_EVENT_TEMP_SAMPLE);
+
 	return IRQ_HANDLED;
 }
 
 static void sun50i_h6_ths_init(struct sun50i_h6_ths_data *data)
 {
-	u32 val;
-	int i;
+	void __iomem *regs = data->regs;
+
+	/* The THERMAL_PER field occupies bits 31:12. */
+	BUILD_BUG_ON(THS_H6_INT_CTRL_THERMAL_PER_VALUE > 0xfffff);
 
-	writel(THS_H6_CTRL0_SENSOR_ACQ0(THS_H6_CTRL0_SENSOR_ACQ0_VALUE) |
-	       THS_H6_CTRL0_UNK, data->regs + THS_H6_CTRL0);
-	writel(THS_H6_FILTER_EN | THS_H6_FILTER_TYPE(THS_H6_FILTER_TYPE_VALUE),
-	       data->regs + THS_H6_FILTER);
+	writel_relaxed(THS_H6_CTRL0_SENSOR_ACQ0(THS_H6_CTRL0_SENSOR_ACQ0_VALUE) |
+		       THS_H6_CTRL0_UNK, regs + THS_H6_CTRL0);
+	writel_relaxed(THS_H6_FILTER_EN |
+		       THS_H6_FILTER_TYPE(THS_H6_FILTER_TYPE_VALUE),
+		       regs + THS_H6_FILTER);
 
-	val = 0;
-	for (i = 0; i < data->cfg->sensor_num; i++)
-		val |= THS_H6_CTRL2_SENSE_EN(i);
-	writel(val, data->regs + THS_H6_CTRL2);
+	writel_relaxed(data->cfg->sense_en_mask, regs + THS_H6_CTRL2);
 
-	val = THS_H6_PER_THERMAL_PER(THS_H6_INT_CTRL_THERMAL_PER_VALUE);
-	writel(val, data->regs + THS_H6_PER);
+	writel_relaxed(sun50i_h6_ths_per_val, regs + THS_H6_PER);
 
-	val = 0;
-	for (i = 0; i < data->cfg->sensor_num; i++)
-		val |= THS_H6_INT_CTRL_DATA_IRQ_EN(i);
-	writel(val, data->regs + THS_H6_DATA_INT_CTRL);
+	writel_relaxed(data->cfg->irq_en_mask, regs + THS_H6_DATA_INT_CTRL);
+
+	/* Make the whole setup visible before the first interrupt fires. */
+	wmb();
 }
 
 static const struct thermal_zone_of_device_ops sun50i_h6_ths_thermal_ops = {
@@ -160,18 +221,25 @@ static const struct thermal_zone_of_device_ops sun50i_h6_ths_thermal_ops = {
 
 static int sun50i_h6_ths_calibrate(struct sun50i_h6_ths_data *data)
 {
-	u16 *caldata;
+	u32 cdata[DIV_ROUND_UP(THS_H6_MAX_SENSOR_NUM, 2)] = {};
+	u16 caldata[1 + THS_H6_MAX_SENSOR_NUM];
+	void __iomem *regs = data->regs;
+	int num = data->cfg->sensor_num;
+	void *cell;
 	size_t callen;
 	int i;
 	int ft_temp;
 	s16 ft_temp_orig_reg, diff, cal_val;
-	u32 reg_val;
 
-	caldata = nvmem_cell_read(data->calcell, &callen);
-	if (IS_ERR(caldata))
-		return PTR_ERR(caldata);
+	cell = nvmem_cell_read(data->calcell, &callen);
+	if (IS_ERR(cell))
+		return PTR_ERR(cell);
+
+	/* One FT temperature half-word plus one value half-word per sensor. */
+	memcpy(caldata, cell, min(callen, sizeof(caldata)));
+	kfree(cell);
 
-	if (callen < 2 + 2 * data->cfg->sensor_num) 
+	if (callen < 2 + 2 * num)
 		return -EINVAL;
 
 	if (!caldata[0])
@@ -185,34 +253,31 @@ static int sun50i_h6_ths_calibrate(struct sun50i_h6_ths_data *data)
 	ft_temp = (caldata[0] & THS_H6_CAL_FT_TEMP_MASK) * 100;
 	ft_temp_orig_reg = sun50i_h6_ths_recalc_reg(ft_temp);
 
-	for (i = 0; i < data->cfg->sensor_num; i++)
+	for (i = 0; i < num; i++)
 	{
 		diff = (ft_temp_orig_reg - (s16)caldata[1 + i]);
 		cal_val = THS_H6_CAL_DEFAULT - diff;
 
-		if (cal_val & ~THS_H6_CAL_VAL_MASK) {
+		if (unlikely(cal_val & ~THS_H6_CAL_VAL_MASK)) {
 			pr_warn("Faulty thermal sensor %d calibration value, beyond the valid range.\n", i);
-			continue;
+			/* Keep the hardware default for this sensor. */
+			cal_val = THS_H6_CAL_DEFAULT;
 		}
 
-		if (i % 2) {
-			reg_val = readl(data->regs + THS_H6_CDATA(i / 2));
-			reg_val &= 0xffff;
-			reg_val |= cal_val << 16;
-			writel(reg_val, data->regs + THS_H6_CDATA(i / 2));
-		} else {
-			writel(cal_val, data->regs + THS_H6_CDATA(i / 2));
-		}
+		cdata[i / 2] |= (u32)(cal_val & 0xffff) << ((i % 2) * 16);
 	}
-	
-	kfree(caldata);
+
+	for (i = 0; i < DIV_ROUND_UP(num, 2); i++)
+		writel_relaxed(cdata[i], regs + THS_H6_CDATA(i));
+	/* Flush the calibration values before the sensors get enabled. */
+	wmb();
+
 	return 0;
 }
 
 static int sun50i_h6_ths_probe(struct platform_device *pdev)
 {
 	struct sun50i_h6_ths_data *data;
-	struct resource *res;
 	int ret, irq, i;
 
 	data = devm_kzalloc(&pdev->dev, sizeof(*data), GFP_KERNEL);
@@ -223,13 +288,7 @@ static int sun50i_h6_ths_probe(struct platform_device *pdev)
 	if (!data->cfg)
 		return -EINVAL;
 
-	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	if (!res) {
-		dev_err(&pdev->dev, "no memory resources defined\n");
-		return -EINVAL;
-	}
-
-	data->regs = devm_ioremap_resource(&pdev->dev, res);
+	data->regs = devm_platform_ioremap_resource(pdev, 0);
 	if (IS_ERR(data->regs)) {
 		ret = PTR_ERR(data->regs);
 		dev_err(&pdev->dev, "failed to ioremap THS registers: %d\n", ret);
@@ -238,12 +297,13 @@ static int sun50i_h6_ths_probe(struct platform_device *pdev)
 
 	irq = platform_get_irq(pdev, 0);
 	if (irq < 0) {
-		dev_err(&pdev->dev, "failed to get IRQ: %d\n", irq);
+		if (irq != -EPROBE_DEFER)
+			dev_err(&pdev->dev, "failed to get IRQ: %d\n", irq);
 		return irq;
 	}
 
-	ret = devm_request_threaded_irq(&pdev->dev, irq, NULL,
-					sun50i_h6_ths_irq_thread, IRQF_ONESHOT,
+	ret = devm_request_threaded_irq(&pdev->dev, irq, sun50i_h6_ths_irq,
+					sun50i_h6_ths_irq_thread, 0,
 					dev_name(&pdev->dev), data);
 	if (ret)
 		return ret;
@@ -251,14 +311,16 @@ static int sun50i_h6_ths_probe(struct platform_device *pdev)
 	data->busclk = devm_clk_get(&pdev->dev, "bus");
 	if (IS_ERR(data->busclk)) {
 		ret = PTR_ERR(data->busclk);
-		dev_err(&pdev->dev, "failed to get ahb clk: %d\n", ret);
+		if (ret != -EPROBE_DEFER)
+			dev_err(&pdev->dev, "failed to get ahb clk: %d\n", ret);
 		return ret;
 	}
 
 	data->reset = devm_reset_control_get(&pdev->dev, NULL);
 	if (IS_ERR(data->reset)) {
 		ret = PTR_ERR(data->reset);
-		dev_err(&pdev->dev, "failed to get reset: %d\n", ret);
+		if (ret != -EPROBE_DEFER)
+			dev_err(&pdev->dev, "failed to get reset: %d\n", ret);
 		return ret;
 	}
 
@@ -295,24 +357,26 @@ static int sun50i_h6_ths_probe(struct platform_device *pdev)
 		ret = sun50i_h6_ths_calibrate(data);
 		if (ret) {
 			/* Revert calibrating */
-			for (i = 0; i < data->cfg->sensor_num; i += 2) {
-				writew(THS_H6_CAL_DEFAULT,
-				       data->regs + THS_H6_CDATA(i / 2));
-			}
+			for (i = 0; i < DIV_ROUND_UP(data->cfg->sensor_num, 2);
+			     i++)
+				writel((THS_H6_CAL_DEFAULT << 16) |
+				       THS_H6_CAL_DEFAULT,
+				       data->regs + THS_H6_CDATA(i));
 		}
 	}
 
 	for (i = 0; i < data->cfg->sensor_num; i++) {
-		data->sensors[i].data = data;
+		data->sensors[i].regs = data->regs;
 		data->sensors[i].id = i;
 		data->sensors[i].tzd =
 			devm_thermal_zone_of_sensor_register(&pdev->dev,
 				i, &data->sensors[i], &sun50i_h6_ths_thermal_ops);
 		if (IS_ERR(data->sensors[i].tzd)) {
 			ret = PTR_ERR(data->sensors[i].tzd);
-			dev_err(&pdev->dev,
-				"failed to register thermal zone %d: %d\n",
-				i, ret);
+			if (ret != -EPROBE_DEFER)
+				dev_err(&pdev->dev,
+					"failed to register thermal zone %d: %d\n",
+					i, ret);
 			goto err_disable_bus;
 		}
 	}
@@ -340,7 +404,9 @@ static int sun50i_h6_ths_remove(struct platform_device *pdev)
 
 static const struct sun50i_h6_ths_cfg sun50i_h6_ths_cfg = {
 	.sensor_num = 2,
-	.calc_temp = sun50i_h6_ths_calc_temp,
+	/* Both SENSE_EN(n) and DATA_IRQ_EN(n) are BIT(n) for each sensor. */
+	.sense_en_mask = GENMASK(1, 0),
+	.irq_en_mask = GENMASK(1, 0),
 };
 
 static const struct of_device_id sun50i_h6_ths_id_table[] = {